@@ -43,6 +43,17 @@
 #define CMD_SPI_MULTI                       0x1D
 
 #define CMD_ULTI_CHECKSUM                   0xEE
+#define CMD_ULTI_SET_BAUD                   0xED        //Switch to the baudrate (32bit, MSB first) after the answer
+#define CMD_ULTI_STREAM_START               0xEC        //Address and length (32bit, MSB first), window size
+#define CMD_ULTI_STREAM_DATA                0xEB        //One page of data, answered once per window
+#define CMD_ULTI_PROGRAM_COMPRESSED         0xEA        //ULTI_COMPRESSED_* flags and LZSS compressed flash data, see main.c
+#define CMD_ULTI_PAGE_CRC                   0xE9        //First page and page count (16bit, MSB first), answers a CRC16 per page
+#define CMD_ULTI_GET_STATS                  0xE8        //Answers pages written, skipped and only erased (16bit, MSB first)
+#define CMD_ULTI_CRC                        0xE7        //Start and length (32bit, MSB first), answers the CRC16-CCITT of that flash range
+#define CMD_ULTI_GET_DIGEST                 0xE6        //Answers the CRC16 (16bit) and length (32bit) of the data programmed since CMD_ENTER_PROGMODE_ISP, CMD_ULTI_SESSION_INFO or CMD_ULTI_STREAM_START, MSB first
+#define CMD_ULTI_SESSION_INFO               0xE5        //Enters programming mode and answers the device info, see ULTI_CAP_*
+#define CMD_ULTI_EEPROM_SNAPSHOT            0xE4        //EEPROM address, length (16bit, MSB first) and settings version, answers the CRC16
+#define CMD_ULTI_EEPROM_RESTORE             0xE3        //Settings version, answers the count of changed bytes (16bit, MSB first)
 
 // *****************[ STK PP command constants ]*******************************
 
@@ -92,6 +103,7 @@
 #define STATUS_CMD_FAILED                   0xC0
 #define STATUS_CKSUM_ERROR                  0xC1
 #define STATUS_CMD_UNKNOWN                  0xC9
+#define STATUS_ULTI_VERIFY_FAILED           0xCF        //Followed by the address of the first wrong byte (32bit, MSB first)
 
 // *****************[ STK parameter constants ]***************************
 #define PARAM_BUILD_NUMBER_LOW              0x80
@@ -110,6 +122,30 @@
 #define PARAM_RESET_POLARITY                0x9E
 #define PARAM_CONTROLLER_INIT               0x9F
 
+#define PARAM_ULTI_BAUD_DIVIDER_LOW         0xC0        //UBRR0 of the current baudrate (with U2X0)
+#define PARAM_ULTI_BAUD_DIVIDER_HIGH        0xC1
+#define PARAM_ULTI_AUTOBAUD_CYCLES_LOW      0xC2        //CPU cycles measured for 8 bits of the autobaud MESSAGE_START
+#define PARAM_ULTI_AUTOBAUD_CYCLES_HIGH     0xC3
+#define PARAM_ULTI_FLASH_MODE               0xC4        //ULTI_FLASH_MODE_* flags
+
+#define ULTI_FLASH_MODE_SKIP_UNCHANGED      0x01        //Do not erase and write pages that already hold the same data
+#define ULTI_FLASH_MODE_VERIFY              0x02        //Read back every programmed page, program commands answer STATUS_ULTI_VERIFY_FAILED on a mismatch
+#define ULTI_FLASH_MODE_WRITE_BEHIND        0x04        //With VERIFY, do not wait for the pages before answering, failures come with a later answer
+
+#define ULTI_COMPRESSED_LAST                0x01        //Last CMD_ULTI_PROGRAM_COMPRESSED packet, it can end in the middle of a page
+
+// CMD_ULTI_SESSION_INFO answer, multi byte values MSB first:
+//  status, signature (3), low/high/extended fuse, lock bits, build number (2), hw version, sw major, sw minor,
+//  page size (2), max packet size of CMD_PROGRAM_FLASH_ISP (2), bootloader start (4), eeprom size (2), ULTI_CAP_* flags, ULTI_FLASH_MODE_* flags
+#define ULTI_CAP_SET_BAUD                   0x01        //CMD_ULTI_SET_BAUD
+#define ULTI_CAP_STREAM                     0x02        //CMD_ULTI_STREAM_START and CMD_ULTI_STREAM_DATA
+#define ULTI_CAP_COMPRESSED                 0x04        //CMD_ULTI_PROGRAM_COMPRESSED
+#define ULTI_CAP_CRC                        0x08        //CMD_ULTI_PAGE_CRC, CMD_ULTI_CRC and CMD_ULTI_GET_DIGEST
+#define ULTI_CAP_VERIFY                     0x10        //ULTI_FLASH_MODE_VERIFY and ULTI_FLASH_MODE_WRITE_BEHIND
+#define ULTI_CAP_AUTOBAUD                   0x20        //The baudrate is detected from the first MESSAGE_START
+#define ULTI_CAP_EEPROM                     0x40        //CMD_PROGRAM_EEPROM_ISP and CMD_READ_EEPROM_ISP
+#define ULTI_CAP_EEPROM_SNAPSHOT            0x80        //CMD_ULTI_EEPROM_SNAPSHOT and CMD_ULTI_EEPROM_RESTORE
+
 // *****************[ STK answer constants ]***************************
 
 #define ANSWER_CKSUM_ERROR                  0xB0
@@ -1,548 +1,1809 @@
-#include <avr/io.h>
-#include <avr/boot.h>
-#include <avr/wdt.h>
-#include <util/delay.h>
-#include <avr/pgmspace.h>
-#include <avr/eeprom.h>
-
-#include "fastio.h"
-#include "pinconfig.h"
-#include "command.h"
-#include "lcd.h"
-#include "petit_fat/pff.h"
-#include "leds.h"
-
-//ATMega1280: Linker setting: -Wl,--section-start=.text=0x1E000
-//ATMega2560: Linker setting: -Wl,--section-start=.text=0x3E000
-
-/************/
-/** CONFIG **/
-/************/
-
-#define UART_BAUD 115200
-
-/*
- * HW and SW version, reported to AVRISP, must match version of AVRStudio
- */
-#define CONFIG_PARAM_BUILD_NUMBER_LOW	0
-#define CONFIG_PARAM_BUILD_NUMBER_HIGH	0
-#define CONFIG_PARAM_HW_VER				0x0F
-#define CONFIG_PARAM_SW_MAJOR			2
-#define CONFIG_PARAM_SW_MINOR			0x0A
-
-#define BOOTSIZE (SPM_PAGESIZE * 32)
-
-/**********/
-/** CODE **/
-/**********/
-
-/*
- * Signature bytes are not available in avr-gcc io_xxx.h
- */
-#if defined (__AVR_ATmega8__)
-	#define SIGNATURE_BYTES 0x1E9307
-#elif defined (__AVR_ATmega16__)
-	#define SIGNATURE_BYTES 0x1E9403
-#elif defined (__AVR_ATmega32__)
-	#define SIGNATURE_BYTES 0x1E9502
-#elif defined (__AVR_ATmega8515__)
-	#define SIGNATURE_BYTES 0x1E9306
-#elif defined (__AVR_ATmega8535__)
-	#define SIGNATURE_BYTES 0x1E9308
-#elif defined (__AVR_ATmega162__)
-	#define SIGNATURE_BYTES 0x1E9404
-#elif defined (__AVR_ATmega128__)
-	#define SIGNATURE_BYTES 0x1E9702
-#elif defined (__AVR_ATmega1280__)
-	#define SIGNATURE_BYTES 0x1E9703
-#elif defined (__AVR_ATmega2560__)
-	#define SIGNATURE_BYTES 0x1E9801
-#elif defined (__AVR_ATmega2561__)
-	#define SIGNATURE_BYTES 0x1e9802
-#else
-	#error "no signature definition for MCU available"
-#endif
-
-#define SERIAL_DATA_AVAILABLE() (UCSR0A & _BV(RXC0))
-#define RECV_SERIAL_DATA() (UDR0)
-#define SEND_SERIAL_DATA(n) do { UDR0 = (n); while(!(UCSR0A & _BV(TXC0))); UCSR0A |= _BV(TXC0); } while(0)
-#define BAUDRATE_DIVIDER() (((F_CPU + (4 * UART_BAUD)) / (8 * UART_BAUD)) - 1)
-
-void serial_send_pstring(const char* str)
-{
-    char c;
-    while((c = pgm_read_byte_far((long)(short)str | 0x10000)) != '\0')
-    {
-        SEND_SERIAL_DATA(c);
-        str++;
-    }
-}
-
-uint8_t __attribute__((section(".noinit"))) MCUSR_backup;
-void disable_watchdog_asap(void) __attribute__((naked)) __attribute__((section(".init3")));
-void disable_watchdog_asap(void)
-{
-    //Disable the watchdog timer, it could have been left on after reset. We need to do this ASAP, as the watchdog could trigger before main is called.
-    //the .init3 section is run before data initialization.
-    MCUSR_backup = MCUSR;
-    MCUSR = 0;
-    wdt_disable();
-}
-
-#define STATE_START  0
-#define STATE_SEQ    1
-#define STATE_SIZE_1 2
-#define STATE_SIZE_2 3
-#define STATE_TOKEN  4
-#define STATE_DATA   5
-#define STATE_CHECK  6
-
-typedef union {
-    uint16_t i16;
-    uint8_t  i8[2];
-} union16t;
-typedef union {
-    uint32_t i32;
-    uint16_t i16[2];
-    uint8_t  i8[4];
-} union32t;
-
-uint8_t msgBuffer[1024];
-uint8_t seq;
-union16t msgLen;
-uint16_t msgPos;
-uint8_t checksum;
-union32t address;
-
-static void handleMessage()
-{
-    switch(msgBuffer[0])
-    {
-    case CMD_SIGN_ON:
-        msgLen.i16		=	11;
-        msgBuffer[1] 	=	STATUS_CMD_OK;
-        msgBuffer[2] 	=	8;
-        msgBuffer[3] 	=	'A';
-        msgBuffer[4] 	=	'V';
-        msgBuffer[5] 	=	'R';
-        msgBuffer[6] 	=	'I';
-        msgBuffer[7] 	=	'S';
-        msgBuffer[8] 	=	'P';
-        msgBuffer[9] 	=	'_';
-        msgBuffer[10]	=	'2';
-        break;
-    case CMD_GET_PARAMETER:
-        switch(msgBuffer[1])
-        {
-        case PARAM_BUILD_NUMBER_LOW:
-            msgBuffer[2] = CONFIG_PARAM_BUILD_NUMBER_LOW;
-            break;
-        case PARAM_BUILD_NUMBER_HIGH:
-            msgBuffer[2] = CONFIG_PARAM_BUILD_NUMBER_HIGH;
-            break;
-        case PARAM_HW_VER:
-            msgBuffer[2] = CONFIG_PARAM_HW_VER;
-            break;
-        case PARAM_SW_MAJOR:
-            msgBuffer[2] = CONFIG_PARAM_SW_MAJOR;
-            break;
-        case PARAM_SW_MINOR:
-            msgBuffer[2] = CONFIG_PARAM_SW_MINOR;
-            break;
-        }
-        msgLen.i16  	=	3;
-        msgBuffer[1] 	=	STATUS_CMD_OK;
-        break;
-//    case CMD_SET_DEVICE_PARAMETERS:
-//    case CMD_OSCCAL:
-    case CMD_LOAD_ADDRESS:
-        address.i8[3]   = msgBuffer[1];
-        address.i8[2]   = msgBuffer[2];
-        address.i8[1]   = msgBuffer[3];
-        address.i8[0]   = msgBuffer[4];
-        address.i32   <<= 1;
-        msgLen.i16 		= 2;
-        msgBuffer[1] 	= STATUS_CMD_OK;
-        break;
-//    case CMD_FIRMWARE_UPGRADE:
-    case CMD_SET_PARAMETER:
-    case CMD_ENTER_PROGMODE_ISP:
-        msgLen.i16 		=	2;
-        msgBuffer[1] 	=	STATUS_CMD_OK;
-        break;
-    case CMD_LEAVE_PROGMODE_ISP:
-        msgLen.i16 		=	2;
-        msgBuffer[1] 	=	STATUS_CMD_OK;
-        //To leave the bootloader, set the timer really fast
-        TCCR1B = _BV(CS10);
-        break;
-    case CMD_CHIP_ERASE_ISP:
-        msgLen.i16 		=	2;
-        msgBuffer[1] 	=	STATUS_CMD_OK;
-
-        {
-            uint16_t n;
-            for(n=0; n<E2END; n++)
-                eeprom_write_byte((unsigned char*)n, 0xFF);
-        }
-        break;
-    case CMD_PROGRAM_FLASH_ISP:
-        {
-            //lcd_home();
-            //lcd_pstring(PSTR("Loading new firmware"));
-            
-            union16t size;
-            size.i8[0] = msgBuffer[2];
-            size.i8[1] = msgBuffer[1];
-            uint8_t* c = &msgBuffer[10];
-            uint32_t oldAddress = address.i32;
-            
-            msgLen.i16 		=	2;
-            msgBuffer[1] 	=	STATUS_CMD_OK;
-            
-            //Protect the bootloader
-            if (address.i32 > FLASHEND - BOOTSIZE - SPM_PAGESIZE)
-                break;
-            
-            boot_page_erase(address.i32);	// Perform page erase
-			boot_spm_busy_wait();		// Wait until the memory is erased.
-			do
-			{
-                union16t data;
-                data.i8[0] = *c++;
-                data.i8[1] = *c++;
-                boot_page_fill(address.i32, data.i16);
-                address.i32 += 2;
-                size.i16 -= 2;
-			} while(size.i16);
-            boot_page_write(oldAddress);
-            boot_spm_busy_wait();
-            boot_rww_enable();
-        }
-        break;
-    case CMD_READ_FLASH_ISP:
-        {
-            union16t size, data;
-            size.i8[0] = msgBuffer[2];
-            size.i8[1] = msgBuffer[1];
-            uint8_t* c = &msgBuffer[2];
-            msgLen.i16 = size.i16 + 3;
-            
-            msgBuffer[1] = STATUS_CMD_OK;
-            do
-            {
-                data.i16 = pgm_read_word_far(address.i32);
-                *c++ = data.i8[0];
-                *c++ = data.i8[1];
-                address.i32 += 2;
-                size.i16 -= 2;
-            }while(size.i16);
-        }
-        break;
-    case CMD_ULTI_CHECKSUM:
-        {
-            union16t checksum;
-            uint32_t tmpAddr = 0;
-            checksum.i16 = 0;
-            while(tmpAddr < address.i32)
-            {
-                union16t tmp;
-                tmp.i16 = pgm_read_word_far(tmpAddr);
-                checksum.i16 += tmp.i8[0];
-                checksum.i16 += tmp.i8[1];
-                tmpAddr += 2;
-            }
-            msgBuffer[2] = checksum.i8[0];
-            msgBuffer[3] = checksum.i8[1];
-            msgLen.i16 = 4;
-            msgBuffer[1] = STATUS_CMD_OK;
-        }
-        break;
-//    case CMD_PROGRAM_EEPROM_ISP:
-        //TODO
-        break;
-//    case CMD_READ_EEPROM_ISP:
-        //TODO
-        break;
-//    case CMD_PROGRAM_FUSE_ISP:
-    case CMD_READ_FUSE_ISP:
-        if ( msgBuffer[2] == 0x50 )
-        {
-            if ( msgBuffer[3] == 0x08 )
-                msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_EXTENDED_FUSE_BITS );
-            else
-                msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_LOW_FUSE_BITS );
-        }
-        else
-        {
-            msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_HIGH_FUSE_BITS );
-        }
-        msgLen.i16		=	4;
-        msgBuffer[1]	=	STATUS_CMD_OK;
-        msgBuffer[3]	=	STATUS_CMD_OK;
-        break;
-    //case CMD_PROGRAM_LOCK_ISP:
-    case CMD_READ_LOCK_ISP:
-        msgLen.i16		=	4;
-        msgBuffer[1]	=	STATUS_CMD_OK;
-        msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_LOCK_BITS );
-        msgBuffer[3]	=	STATUS_CMD_OK;
-        break;
-    case CMD_READ_SIGNATURE_ISP:
-        if ( msgBuffer[4] == 0 )
-            msgBuffer[2] = (SIGNATURE_BYTES >>16) & 0x000000FF;
-        else if ( msgBuffer[4] == 1 )
-            msgBuffer[2] = (SIGNATURE_BYTES >> 8) & 0x000000FF;
-        else
-            msgBuffer[2] = SIGNATURE_BYTES & 0x000000FF;
-        msgLen.i16      =	4;
-        msgBuffer[1]	=	STATUS_CMD_OK;
-        msgBuffer[3]	=	STATUS_CMD_OK;
-        break;
-//    case CMD_READ_OSCCAL_ISP:
-    case CMD_SPI_MULTI:
-        //Implement only the signature bytes reading for raw ISP commands, avrdude needs this.
-        msgBuffer[5]	=	0;
-        if ( msgBuffer[4] == 0x30 )
-        {
-            if ( msgBuffer[6] == 0 )
-                msgBuffer[5]	=	(SIGNATURE_BYTES >>16) & 0x000000FF;
-            else if ( msgBuffer[6] == 1 )
-                msgBuffer[5]	=	(SIGNATURE_BYTES >> 8) & 0x000000FF;
-            else
-                msgBuffer[5]	=	SIGNATURE_BYTES & 0x000000FF;
-        }
-        
-        msgLen.i16		=	7;
-        msgBuffer[1]	=	STATUS_CMD_OK;
-        msgBuffer[2]	=	0;
-        msgBuffer[3]	=	msgBuffer[4];
-        msgBuffer[4]	=	0;
-        msgBuffer[6]	=	STATUS_CMD_OK;
-        break;
-    default:
-        msgLen.i16 		=	2;
-        msgBuffer[1] 	=	STATUS_CMD_FAILED;
-        break;
-    }
-    SEND_SERIAL_DATA(MESSAGE_START);
-    SEND_SERIAL_DATA(seq);
-    SEND_SERIAL_DATA(msgLen.i8[1]);
-    SEND_SERIAL_DATA(msgLen.i8[0]);
-    SEND_SERIAL_DATA(TOKEN);
-    checksum = MESSAGE_START ^ seq ^ (msgLen.i8[0]) ^ (msgLen.i8[1]) ^ (TOKEN);
-    for(msgPos = 0; msgPos < msgLen.i16; msgPos++)
-    {
-        SEND_SERIAL_DATA(msgBuffer[msgPos]);
-        checksum ^= msgBuffer[msgPos];
-    }
-    SEND_SERIAL_DATA(checksum);
-    
-    seq++;
-}
-
-void main()
-{
-    uint8_t recvState = STATE_START;
-    uint8_t hasFirmware = (pgm_read_byte(0) == 0xFF);
-    FATFS fat;
-    
-    //lcd_init();
-    if (hasFirmware)
-    {
-        //lcd_pstring(PSTR("No firmware found..."));
-    }else{
-        //lcd_pstring(PSTR("Ultimaker starting.."));
-    }
-    
-    SET_INPUT(BTN_ENC);
-    WRITE(BTN_ENC, 1);//Enable the pull-up on the button input.
-    
-    //Setup the serial with 8n1, no interrupts and the configured baudrate.
-    UCSR0A = _BV(U2X0);
-    UCSR0B = _BV(RXEN0) | _BV(TXEN0);
-    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
-    UBRR0H = BAUDRATE_DIVIDER() >> 8;
-    UBRR0L = BAUDRATE_DIVIDER();
-    
-    if (MCUSR_backup & _BV(WDRF))
-    {
-        //If we had a hardware watchdog timeout, report that to the user and don't do anything else.
-        //As a hardware watchdog error is a critical error and should not recover.
-        //lcd_clear();
-        //lcd_pstring(PSTR("Hardware watchdog"));
-        //lcd_set_pos(0x40);
-        //lcd_pstring(PSTR("timeout..."));
-        //led_write(8, 0x01);
-        while(1)
-        {
-            serial_send_pstring(PSTR("Error: Hardware watchdog timeout\n"));
-        }
-    }
-
-    //Setup a bootloader timeout timer, use a 16bit timer. And wait for the overflow.
-    //With a 1024 prescaler this gives a ~4.1 second timeout.
-    //With a 256 prescaler this gives a ~1 second timeout.
-    //TCCR1B = _BV(CS12) | _BV(CS10);//1024 prescaler
-    TCCR1B = _BV(CS12);//256 prescaler
-    //TCCR1B = _BV(CS11) | _BV(CS10);//64 prescaler
-    TIFR1 = _BV(TOV1);
-    TCNT1H = 0;
-    TCNT1L = 0;
-    
-    while(!(TIFR1 & _BV(TOV1)))
-    {
-        if (SERIAL_DATA_AVAILABLE())
-        {
-            uint8_t data = RECV_SERIAL_DATA();
-            
-            checksum ^= data;
-            switch(recvState)
-            {
-            case STATE_START:
-                if (data == MESSAGE_START)
-                {
-                    recvState = STATE_SEQ;
-                    checksum = MESSAGE_START;
-                    //Reset the bootloader timeout
-                    TCNT1H = 0;
-                    TCNT1L = 0;
-                    //led_write(8, 0x00);
-                }
-                break;
-            case STATE_SEQ:
-                if ((data == 1) || (data == seq))
-                {
-                    seq = data;
-                    recvState = STATE_SIZE_1;
-                }else{
-                    recvState = STATE_START;
-                }
-                break;
-            case STATE_SIZE_1:
-                msgLen.i8[1] = data;
-                recvState = STATE_SIZE_2;
-                break;
-            case STATE_SIZE_2:
-                msgLen.i8[0] = data;
-                recvState = STATE_TOKEN;
-                break;
-            case STATE_TOKEN:
-                if (data == TOKEN)
-                {
-                    recvState = STATE_DATA;
-                    msgPos = 0;
-                }else{
-                    recvState = STATE_START;
-                }
-                break;
-            case STATE_DATA:
-                msgBuffer[msgPos++] = data;
-                if (msgPos == msgLen.i16)
-                    recvState = STATE_CHECK;
-                break;
-            case STATE_CHECK:
-                //led_write(8, 0x2A);
-                if (checksum == 0)
-                    handleMessage();
-                recvState = STATE_START;
-                break;
-            }
-        }
-    }
-
-    /*
-    //Try the SD card to see if there is a firmware on it.
-    if (pf_mount(&fat) == 0 && pf_open("/firmware.bin") == 0)
-    {
-        led_write(8, 0x0A);
-        TCCR1B = _BV(CS12) | _BV(CS10);//1024 prescaler for 4 second timeout
-        TIFR1 = _BV(TOV1);
-        TCNT1H = 0;
-        TCNT1L = 0;
-        lcd_clear();
-        lcd_pstring(PSTR("Press button to"));
-        lcd_set_pos(0x40);
-        lcd_pstring(PSTR("upgrade firmware"));
-        while(!(TIFR1 & _BV(TOV1)))
-        {
-            if (hasFirmware || !READ(BTN_ENC))
-            {
-                lcd_clear();
-                lcd_pstring(PSTR("Upgrading firmware"));
-                
-                uint8_t buffer[SPM_PAGESIZE];
-                uint32_t address = 0;
-                while(1)
-                {
-                    WORD len;
-                    long oldAddress = address;
-                    
-                    pf_read(buffer, SPM_PAGESIZE, &len);
-                    if (len == 0)
-                        break;
-                    lcd_set_pos(0x40 + address * 20L / fat.fsize);
-                    lcd_send_8bit(0xFF);
-                    //Protect the bootloader
-                    if (address > FLASHEND - BOOTSIZE - SPM_PAGESIZE)
-                        break;
-
-                    boot_page_erase(address);	// Perform page erase
-                    boot_spm_busy_wait();		// Wait until the memory is erased.
-                    uint8_t* c = buffer;
-                    do
-                    {
-                        union16t data;
-                        data.i8[0] = *c++;
-                        data.i8[1] = *c++;
-                        boot_page_fill(address, data.i16);
-                        address += 2;
-                        len -= 2;
-                    } while(len);
-                    boot_page_write(oldAddress);
-                    boot_spm_busy_wait();
-                    boot_rww_enable();
-                }
-                lcd_clear();
-                lcd_pstring(PSTR("Checking firmware"));
-                //Reopen the firmware to reset the file read pointer
-                pf_open("/firmware.bin");
-                address = 0;
-                while(1)
-                {
-                    WORD len;
-                    
-                    pf_read(buffer, SPM_PAGESIZE, &len);
-                    if (len == 0)
-                        break;
-                    lcd_set_pos(0x40 + address * 20L / fat.fsize);
-                    lcd_send_8bit(0xFF);
-                    
-                    uint8_t* c = buffer;
-                    do
-                    {
-                        if (*c++ != pgm_read_byte_far(address))
-                        {
-                            lcd_clear();
-                            lcd_pstring(PSTR("FAILED!"));
-                            while(1);
-                        }
-                        address ++;
-                        len --;
-                    } while(len);
-                }
-                lcd_clear();
-                lcd_pstring(PSTR("DONE!"));
-                break;
-            }
-        }
-    }
-    */
-
-    //Jump to address 0x0000
-	asm volatile(
-			"clr	r30		\n\t"
-			"clr	r31		\n\t"
-			"ijmp	\n\t"
-			);
-}
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <string.h>
+
+#include "fastio.h"
+#include "pinconfig.h"
+#include "command.h"
+#include "lcd.h"
+#include "petit_fat/pff.h"
+#include "leds.h"
+
+//ATMega1280: Linker setting: -Wl,--section-start=.text=0x1E000
+//ATMega2560: Linker setting: -Wl,--section-start=.text=0x3E000
+
+/************/
+/** CONFIG **/
+/************/
+
+#define UART_BAUD 115200
+//Measure the baudrate of the host on the first MESSAGE_START it sends. UART_BAUD is only used until then.
+#define AUTOBAUD
+//After CMD_ULTI_SET_BAUD a valid packet has to arrive at the new baudrate within this time, else we fall back.
+//Timer3 with a 64 prescaler overflows after ~262ms.
+#define BAUD_FALLBACK_PRESCALER (_BV(CS31) | _BV(CS30))
+
+/*
+ * HW and SW version, reported to AVRISP, must match version of AVRStudio
+ */
+#define CONFIG_PARAM_BUILD_NUMBER_LOW	0
+#define CONFIG_PARAM_BUILD_NUMBER_HIGH	0
+#define CONFIG_PARAM_HW_VER				0x0F
+#define CONFIG_PARAM_SW_MAJOR			2
+#define CONFIG_PARAM_SW_MINOR			0x0A
+
+#define BOOTSIZE (SPM_PAGESIZE * 32)
+//First flash address of the bootloader, pages from here on are never programmed.
+#define BOOTSTART (FLASHEND + 1UL - BOOTSIZE)
+
+//Number of pages that can be waiting for the flash programming engine, must be a power of 2.
+#define FLASH_QUEUE_SIZE 8
+
+/**********/
+/** CODE **/
+/**********/
+
+/*
+ * Signature bytes are not available in avr-gcc io_xxx.h
+ */
+#if defined (__AVR_ATmega8__)
+	#define SIGNATURE_BYTES 0x1E9307
+#elif defined (__AVR_ATmega16__)
+	#define SIGNATURE_BYTES 0x1E9403
+#elif defined (__AVR_ATmega32__)
+	#define SIGNATURE_BYTES 0x1E9502
+#elif defined (__AVR_ATmega8515__)
+	#define SIGNATURE_BYTES 0x1E9306
+#elif defined (__AVR_ATmega8535__)
+	#define SIGNATURE_BYTES 0x1E9308
+#elif defined (__AVR_ATmega162__)
+	#define SIGNATURE_BYTES 0x1E9404
+#elif defined (__AVR_ATmega128__)
+	#define SIGNATURE_BYTES 0x1E9702
+#elif defined (__AVR_ATmega1280__)
+	#define SIGNATURE_BYTES 0x1E9703
+#elif defined (__AVR_ATmega2560__)
+	#define SIGNATURE_BYTES 0x1E9801
+#elif defined (__AVR_ATmega2561__)
+	#define SIGNATURE_BYTES 0x1e9802
+#else
+	#error "no signature definition for MCU available"
+#endif
+
+#define SERIAL_DATA_AVAILABLE() (rxHead != rxTail)
+#define RECV_SERIAL_DATA() serial_recv()
+#define SEND_SERIAL_DATA(n) serial_send(n)
+#define BAUDRATE_DIVIDER() (((F_CPU + (4 * UART_BAUD)) / (8 * UART_BAUD)) - 1)
+
+/*
+ * Serial receive ring buffer, filled from the USART0 RX interrupt so no data is lost while a message is being handled.
+ * The indexes are 8 bit, so a 256 byte buffer wraps around without masking.
+ */
+uint8_t rxBuffer[256];
+volatile uint8_t rxHead;
+volatile uint8_t rxTail;
+//One bit per buffer position, set on a framing error, data overrun or buffer overflow at that position.
+//A bit per position keeps every error, also when a second one happens before the first is handled.
+volatile uint8_t rxErrorMap[256 / 8];
+
+ISR(USART0_RX_vect)
+{
+    uint8_t status = UCSR0A;
+    uint8_t data = UDR0;
+    uint8_t next = rxHead + 1;
+    if ((status & (_BV(FE0) | _BV(DOR0))) || next == rxTail)
+        rxErrorMap[rxHead >> 3] |= _BV(rxHead & 7);
+    //On a buffer overflow the byte is dropped.
+    if (next != rxTail)
+    {
+        rxBuffer[rxHead] = data;
+        rxHead = next;
+    }
+}
+
+static uint8_t serial_recv()
+{
+    uint8_t data = rxBuffer[rxTail];
+    rxTail++;
+    return data;
+}
+
+//Check and clear the error flag of the next byte to receive, data before it was lost or corrupted.
+static uint8_t serial_recv_error()
+{
+    uint8_t bit = _BV(rxTail & 7);
+    uint8_t error;
+    cli();
+    error = rxErrorMap[rxTail >> 3] & bit;
+    rxErrorMap[rxTail >> 3] &= ~bit;
+    sei();
+    return error;
+}
+
+/*
+ * Serial transmit queue, drained by the USART0 data register empty interrupt.
+ * Sending only blocks when the queue is full, so the CPU can continue while an answer is on the wire.
+ */
+uint8_t txBuffer[256];
+volatile uint8_t txHead;
+volatile uint8_t txTail;
+uint8_t txActive;
+
+ISR(USART0_UDRE_vect)
+{
+    if (txHead != txTail)
+    {
+        UCSR0A |= _BV(TXC0);
+        UDR0 = txBuffer[txTail];
+        txTail++;
+    }else{
+        UCSR0B &= ~_BV(UDRIE0);
+    }
+}
+
+static void serial_send(uint8_t data)
+{
+    uint8_t next = txHead + 1;
+    while(next == txTail);
+    txBuffer[txHead] = data;
+    txHead = next;
+    txActive = 1;
+    UCSR0B |= _BV(UDRIE0);
+}
+
+static void serial_flush()
+{
+    //Wait till the queue is empty and the last byte has left the shift register.
+    if (!txActive)
+        return;
+    while(UCSR0B & _BV(UDRIE0));
+    while(!(UCSR0A & _BV(TXC0)));
+    txActive = 0;
+}
+
+//UBRR0 value of the confirmed baudrate, and if set, the baudrate that has to be confirmed before the fallback timer runs out.
+uint16_t baudDivider;
+uint8_t baudPending;
+
+static void serial_set_divider(uint16_t divider)
+{
+    UBRR0H = divider >> 8;
+    UBRR0L = divider;
+    //Anything received so far is garbage at the new baudrate, including its errors.
+    cli();
+    rxTail = rxHead;
+    memset((uint8_t*)rxErrorMap, 0, sizeof(rxErrorMap));
+    sei();
+}
+
+#ifdef AUTOBAUD
+//Length of 8 bits of the MESSAGE_START used for autobaud, in CPU cycles. Reported to the host to keep track of the link.
+uint16_t autobaudCycles;
+
+#define RXD_HIGH() (PINE & _BV(PINE0))
+#define AUTOBAUD_WAIT(cond) do { uint16_t n = 0; while(cond) { if (--n == 0) return 0; } } while(0)
+
+/*
+ * Measure the baudrate on the MESSAGE_START (0x1B) byte that starts the first packet. On the line (LSB first) this is:
+ *   start 1 1 0 1 1 0 0 0 stop
+ * The line goes high 1 bit after the falling edge of the start bit, and goes high into the stop bit 8 bits later.
+ * Timer3 runs at the CPU clock to time the edges, the receiver is enabled right away so the next byte is not missed.
+ * Returns 0 when the bootloader timeout passed, or when this did not look like a MESSAGE_START.
+ */
+static uint8_t autobaud()
+{
+    uint16_t start, bit, cycles, divider;
+    
+    //The receiver is off, so clear the receive buffer now. After the last edge there is no time for it.
+    rxTail = rxHead;
+    memset((uint8_t*)rxErrorMap, 0, sizeof(rxErrorMap));
+    while(RXD_HIGH())
+    {
+        if (TIFR1 & _BV(TOV1))
+            return 0;
+    }
+    start = TCNT3;
+    AUTOBAUD_WAIT(!RXD_HIGH());
+    bit = TCNT3;
+    AUTOBAUD_WAIT(RXD_HIGH());
+    AUTOBAUD_WAIT(!RXD_HIGH());
+    AUTOBAUD_WAIT(RXD_HIGH());
+    AUTOBAUD_WAIT(!RXD_HIGH());
+    cycles = TCNT3 - bit;
+    
+    //With U2X0 a bit is 8 * (UBRR0 + 1) cycles, so 8 bits are 64 * (UBRR0 + 1) cycles.
+    //The next start bit can follow 1 stop bit after this edge, so only start the receiver here and check afterwards.
+    divider = ((cycles + 32) >> 6) - 1;
+    UBRR0 = divider;
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+    
+    //The start bit has to be 1/8th of the measured time, else this was not a MESSAGE_START.
+    bit -= start;
+    if (cycles < 64 || bit < (cycles >> 3) - (cycles >> 5) || bit > (cycles >> 3) + (cycles >> 5))
+    {
+        UCSR0B = _BV(TXEN0);
+        return 0;
+    }
+    baudDivider = divider;
+    autobaudCycles = cycles;
+    return 1;
+}
+#endif
+
+void serial_send_pstring(const char* str)
+{
+    char c;
+    while((c = pgm_read_byte_far((long)(short)str | 0x10000)) != '\0')
+    {
+        SEND_SERIAL_DATA(c);
+        str++;
+    }
+}
+
+uint8_t __attribute__((section(".noinit"))) MCUSR_backup;
+void disable_watchdog_asap(void) __attribute__((naked)) __attribute__((section(".init3")));
+void disable_watchdog_asap(void)
+{
+    //Disable the watchdog timer, it could have been left on after reset. We need to do this ASAP, as the watchdog could trigger before main is called.
+    //the .init3 section is run before data initialization.
+    MCUSR_backup = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+#define STATE_START  0
+#define STATE_SEQ    1
+#define STATE_SIZE_1 2
+#define STATE_SIZE_2 3
+#define STATE_TOKEN  4
+#define STATE_DATA   5
+#define STATE_CHECK  6
+
+typedef union {
+    uint16_t i16;
+    uint8_t  i8[2];
+} union16t;
+typedef union {
+    uint32_t i32;
+    uint16_t i16[2];
+    uint8_t  i8[4];
+} union32t;
+
+/*
+ * Flash programming engine.
+ * Pages are queued with flash_queue_next()/flash_queue_push() and programmed from the SPM ready interrupt,
+ * so the serial and SD code can continue while the RWW section is busy. We run from the NRWW section, so this is allowed.
+ * The flash (except for the bootloader) cannot be read while the engine is busy, use flash_wait() before reading.
+ */
+#define FLASH_IDLE       0
+#define FLASH_ERASE      1
+#define FLASH_WRITE      2
+#define FLASH_ERASE_ONLY 3
+
+typedef struct {
+    uint32_t address;
+    uint8_t sweep;//Queued by the chip erase, not counted in the statistics.
+    uint8_t data[SPM_PAGESIZE];
+} flashpaget;
+
+flashpaget flashQueue[FLASH_QUEUE_SIZE];
+volatile uint8_t flashQueueHead;
+volatile uint8_t flashQueueTail;
+volatile uint8_t flashState;
+
+//ULTI_FLASH_MODE_* flags, set with PARAM_ULTI_FLASH_MODE. Statistics of the engine since CMD_ENTER_PROGMODE_ISP.
+uint8_t flashMode = ULTI_FLASH_MODE_SKIP_UNCHANGED | ULTI_FLASH_MODE_WRITE_BEHIND;
+volatile uint16_t flashPagesWritten;
+volatile uint16_t flashPagesSkipped;
+volatile uint16_t flashPagesErased;
+//Set by the verify of ULTI_FLASH_MODE_VERIFY, with the address of the first byte that did not program correctly.
+volatile uint8_t flashError;
+volatile uint32_t flashErrorAddress;
+
+/*
+ * Streaming reads of the flash above 64KB. pgm_read_byte_far() loads RAMPZ and Z for every byte and the caller keeps a
+ * 32bit address, ELPM Z+ increments RAMPZ:Z as a whole, so RAMPZ only has to be loaded once for any range.
+ * Estimated cycles per byte of the read itself, and of the loops that use it (old -> new):
+ *   pgm_read_byte_far(address++)                   out RAMPZ, movw, elpm, 32bit increment   ~9
+ *   pgm_read_word_far(address), address += 2       per word ~14                              ~7
+ *   flash_read_next()                              elpm Z+                                  3
+ *   CMD_READ_FLASH_ISP                             ~11 -> ~5, it is now limited by the serial
+ *   CMD_ULTI_CHECKSUM                              ~13 -> ~8
+ *   flash_page_scan() / flash_page_verify()        ~19 -> ~13, ~5000 -> ~3300 per page
+ *   flash_crc()                                    ~24 -> ~17
+ * Interrupts that use RAMPZ have to restore it, like SPM_READY_vect does.
+ */
+#define flash_read_start(address) (RAMPZ = (uint32_t)(address) >> 16, (uint16_t)(address))
+#define flash_read_next(z) \
+    (__extension__({                        \
+        uint8_t __result;                   \
+        __asm__ __volatile__ (              \
+            "elpm %0, Z+\n\t"               \
+            : "=r" (__result), "+z" (z)     \
+        );                                  \
+        __result;                           \
+    }))
+
+//Results of flash_page_scan()
+#define PAGE_SAME        0x01
+#define PAGE_BLANK       0x02
+#define PAGE_FLASH_BLANK 0x04
+
+//Compare a queued page with the flash contents and check both for all 0xFF in a single pass, the RWW section has to be readable.
+static uint8_t flash_page_scan(flashpaget* page)
+{
+    uint8_t dataBits = 0xFF;
+    uint8_t flashBits = 0xFF;
+    uint8_t diff = 0;
+    uint8_t* c = page->data;
+    uint16_t z = flash_read_start(page->address);
+    uint16_t n;
+    for(n = 0; n < SPM_PAGESIZE; n++)
+    {
+        uint8_t f = flash_read_next(z);
+        uint8_t d = *c++;
+        dataBits &= d;
+        flashBits &= f;
+        diff |= f ^ d;
+    }
+    return (diff ? 0 : PAGE_SAME) | (dataBits == 0xFF ? PAGE_BLANK : 0) | (flashBits == 0xFF ? PAGE_FLASH_BLANK : 0);
+}
+
+//Compare a freshly programmed page with its queue slot, only the first failure is kept till it is reported.
+static void flash_page_verify(flashpaget* page)
+{
+    uint16_t z = flash_read_start(page->address);
+    uint16_t n;
+    for(n = 0; n < SPM_PAGESIZE; n++)
+    {
+        if (flash_read_next(z) != page->data[n])
+        {
+            if (!flashError)
+            {
+                flashErrorAddress = page->address + n;
+                flashError = 1;
+            }
+            return;
+        }
+    }
+}
+
+//Start a page erase or write with the SPM ready interrupt enabled, so SPM_READY_vect continues when it is done.
+#define boot_spm_start(address, command) \
+    __asm__ __volatile__ (                  \
+        "movw r30, %A2\n\t"                  \
+        "sts  %1, %C2\n\t"                   \
+        "sts  %0, %3\n\t"                    \
+        "spm\n\t"                            \
+        :                                   \
+        : "i" (_SFR_MEM_ADDR(__SPM_REG)),   \
+          "i" (_SFR_MEM_ADDR(RAMPZ)),       \
+          "r" ((uint32_t)(address)),        \
+          "r" ((uint8_t)((command) | _BV(SPMIE))) \
+        : "r30", "r31"                      \
+    )
+
+ISR(SPM_READY_vect)
+{
+    uint8_t rampz = RAMPZ;
+    flashpaget* page;
+    
+    //This interrupt keeps firing while it is enabled and SPM is ready, so disable it before allowing other interrupts.
+    //Interrupts are enabled during the work here to keep the serial running, but SPM sequences need to be atomic.
+    SPMCSR = 0;
+    sei();
+    if (flashState == FLASH_ERASE)
+    {
+        page = &flashQueue[flashQueueTail & (FLASH_QUEUE_SIZE - 1)];
+        cli();
+        boot_spm_start(page->address, __BOOT_PAGE_WRITE);
+        flashState = FLASH_WRITE;
+    }else{
+        if (flashState != FLASH_IDLE)
+        {
+            cli();
+            boot_rww_enable();
+            sei();
+            boot_spm_busy_wait();
+            if (flashMode & ULTI_FLASH_MODE_VERIFY)
+                flash_page_verify(&flashQueue[flashQueueTail & (FLASH_QUEUE_SIZE - 1)]);
+            flashQueueTail++;
+            flashState = FLASH_IDLE;
+        }
+        while(flashQueueTail != flashQueueHead)
+        {
+            page = &flashQueue[flashQueueTail & (FLASH_QUEUE_SIZE - 1)];
+            uint8_t scan = flash_page_scan(page);
+            if (((flashMode & ULTI_FLASH_MODE_SKIP_UNCHANGED) && (scan & PAGE_SAME)) || (scan & (PAGE_BLANK | PAGE_FLASH_BLANK)) == (PAGE_BLANK | PAGE_FLASH_BLANK))
+            {
+                //The flash already holds this page, so there is no need to erase and write it.
+                if (!page->sweep)
+                    flashPagesSkipped++;
+                flashQueueTail++;
+                continue;
+            }
+            eeprom_busy_wait();
+            if (scan & PAGE_BLANK)
+            {
+                //Erased flash reads as 0xFF, so an all 0xFF page only needs the erase.
+                cli();
+                boot_spm_start(page->address, __BOOT_PAGE_ERASE);
+                flashState = FLASH_ERASE_ONLY;
+                if (!page->sweep)
+                    flashPagesErased++;
+                break;
+            }
+            //The temporary page buffer survives a page erase, so fill it first. Only the offset in the page matters for filling.
+            uint8_t* c = page->data;
+            uint16_t n;
+            for(n = 0; n < SPM_PAGESIZE; n += 2)
+            {
+                union16t data;
+                data.i8[0] = *c++;
+                data.i8[1] = *c++;
+                cli();
+                boot_page_fill(n, data.i16);
+                sei();
+            }
+            cli();
+            flashPagesWritten++;
+            if (scan & PAGE_FLASH_BLANK)
+            {
+                //Never erase a blank page again, a write can only clear bits.
+                boot_spm_start(page->address, __BOOT_PAGE_WRITE);
+                flashState = FLASH_WRITE;
+                break;
+            }
+            boot_spm_start(page->address, __BOOT_PAGE_ERASE);
+            flashState = FLASH_ERASE;
+            break;
+        }
+        //The EEPROM writer waits for the flash, let it continue.
+        if (flashState == FLASH_IDLE)
+            EECR |= _BV(EERIE);
+    }
+    cli();
+    RAMPZ = rampz;
+}
+
+//Get free page n (counting from the first free one) of the flash queue, waits till the programming engine has room.
+static flashpaget* flash_queue_next(uint8_t n)
+{
+    while((uint8_t)(flashQueueHead - flashQueueTail) >= FLASH_QUEUE_SIZE - n);
+    return &flashQueue[(flashQueueHead + n) & (FLASH_QUEUE_SIZE - 1)];
+}
+
+//Hand the first count pages from flash_queue_next() to the programming engine.
+static void flash_queue_push(uint8_t count)
+{
+    flashQueueHead += count;
+    cli();
+    if (flashState == FLASH_IDLE)
+        SPMCSR = _BV(SPMIE);
+    sei();
+}
+
+//CRC16-CCITT (polynomial 0x1021, MSB first) lookup table. It is built in RAM at startup, a table in the bootloader
+// would need far reads. One lookup replaces the 8 shift steps of _crc_xmodem_update and gives the same results.
+uint16_t crcTable[256];
+
+static void crc_init()
+{
+    uint16_t n;
+    for(n = 0; n < 256; n++)
+        crcTable[n] = _crc_xmodem_update(0, n);
+}
+
+static inline uint16_t crc_update(uint16_t crc, uint8_t data)
+{
+    return (crc << 8) ^ crcTable[(crc >> 8) ^ data];
+}
+
+//CRC16-CCITT over a range of flash, the programming engine has to be idle.
+static uint16_t flash_crc(uint16_t crc, uint32_t address, uint32_t length)
+{
+    uint16_t z = flash_read_start(address);
+    while(length)
+    {
+        //Count in 16bit inside a block, the address itself is carried in RAMPZ:Z.
+        uint16_t count = length > 0x8000 ? 0x8000 : length;
+        length -= count;
+        do
+        {
+            crc = crc_update(crc, flash_read_next(z));
+        }while(--count);
+    }
+    return crc;
+}
+
+/*
+ * Lazy chip erase. CMD_CHIP_ERASE_ISP only marks all application pages in flashEraseMap and starts the EEPROM sweep
+ * of EE_READY_vect. Pages that are programmed are taken off the map, programming erases them anyway. The rest is only
+ * erased by flash_erase_finish(), before the flash is read or the application is started, and blank pages are skipped.
+ */
+#define APP_PAGES (BOOTSTART / SPM_PAGESIZE)
+uint8_t flashEraseMap[APP_PAGES / 8];
+uint8_t flashErasePending;
+volatile uint16_t eepromErase = E2END + 1;
+
+/*
+ * Staging of flash data straight into the flash queue while it is received, so it is never copied through msgBuffer.
+ * The staged pages are only handed to the programming engine by flash_stage_commit(), so a packet with a bad checksum
+ * is thrown away by simply not committing it.
+ */
+uint32_t stageAddress;
+uint16_t stageBytes;
+uint8_t stagePages;
+flashpaget* stagePage;
+//Digest of the image: CRC16-CCITT (polynomial 0x1021, MSB first) and length of all flash data committed to the programming
+// engine, in the order it was sent. Data for the bootloader section is not programmed, so it is not included either.
+//It is reset by CMD_ENTER_PROGMODE_ISP, CMD_ULTI_SESSION_INFO and CMD_ULTI_STREAM_START.
+//It is updated per byte while receiving, so it is ready without reading the flash again.
+//stageCrc and stageBytes include the data that is staged but not committed yet.
+uint16_t flashCrc = 0xFFFF;
+uint32_t flashBytes;
+uint16_t stageCrc;
+
+static void flash_digest_reset()
+{
+    flashCrc = 0xFFFF;
+    flashBytes = 0;
+}
+
+static void flash_stage_begin(uint32_t address)
+{
+    stageAddress = address;
+    stageBytes = 0;
+    stagePages = 0;
+    stagePage = NULL;
+    stageCrc = flashCrc;
+}
+
+static void flash_stage_byte(uint8_t data)
+{
+    uint8_t offset = stageAddress & (SPM_PAGESIZE - 1);
+    if (!stagePage)
+    {
+        stagePage = flash_queue_next(stagePages);
+        stagePage->address = stageAddress - offset;
+        stagePage->sweep = 0;
+        memset(stagePage->data, 0xFF, offset);
+    }
+    stagePage->data[offset] = data;
+    if (stageAddress < BOOTSTART)
+    {
+        stageCrc = crc_update(stageCrc, data);
+        stageBytes++;
+    }
+    stageAddress++;
+    if (offset == SPM_PAGESIZE - 1)
+    {
+        stagePages++;
+        stagePage = NULL;
+    }
+}
+
+static void flash_stage_commit()
+{
+    uint8_t n;
+    
+    //Pad a partially staged page with 0xFF, which is what erased flash reads as.
+    if (stagePage)
+    {
+        uint8_t offset = stageAddress & (SPM_PAGESIZE - 1);
+        memset(&stagePage->data[offset], 0xFF, SPM_PAGESIZE - offset);
+        stagePages++;
+        stagePage = NULL;
+    }
+    //Protect the bootloader, the staged pages are in order so only the pages before the bootloader are committed.
+    for(n = 0; n < stagePages; n++)
+    {
+        uint32_t pageAddress = flashQueue[(flashQueueHead + n) & (FLASH_QUEUE_SIZE - 1)].address;
+        if (pageAddress >= BOOTSTART)
+            break;
+        uint16_t page = pageAddress / SPM_PAGESIZE;
+        flashEraseMap[page >> 3] &= ~_BV(page & 7);
+    }
+    flash_queue_push(n);
+    stagePages = 0;
+    flashCrc = stageCrc;
+    flashBytes += stageBytes;
+    stageBytes = 0;
+}
+
+//Wait till all queued pages are programmed and the RWW section can be read again.
+static void flash_wait()
+{
+    while(flashQueueHead != flashQueueTail);
+}
+
+//Erase the application pages still marked by a chip erase. They are queued as all 0xFF pages, so the engine only
+// erases them, or skips them when they are blank already. Must not be called while a packet is staged.
+static void flash_erase_finish()
+{
+    uint16_t page;
+    if (flashErasePending)
+    {
+        flashErasePending = 0;
+        for(page = 0; page < APP_PAGES; page++)
+        {
+            if (flashEraseMap[page >> 3] & _BV(page & 7))
+            {
+                flashEraseMap[page >> 3] &= ~_BV(page & 7);
+                flashpaget* erasePage = flash_queue_next(0);
+                erasePage->address = (uint32_t)page * SPM_PAGESIZE;
+                erasePage->sweep = 1;
+                memset(erasePage->data, 0xFF, SPM_PAGESIZE);
+                flash_queue_push(1);
+            }
+        }
+    }
+    flash_wait();
+}
+
+/*
+ * EEPROM writer, the EE_READY interrupt writes the queued bytes while the serial keeps going.
+ * EEPROM and SPM cannot run at the same time, and an EEPROM write clears the temporary page buffer, so the writer waits
+ * while the flash queue is not empty, and SPM_READY_vect starts it again when the queue is done.
+ * A chip erase sweep goes before the queued bytes, as they were queued after the CMD_CHIP_ERASE_ISP.
+ */
+#define EEPROM_QUEUE_SIZE 16
+typedef struct
+{
+    uint16_t address;
+    uint8_t data;
+} eepromwritet;
+eepromwritet eepromQueue[EEPROM_QUEUE_SIZE];
+volatile uint8_t eepromQueueHead;
+volatile uint8_t eepromQueueTail;
+
+/*
+ * Snapshot of the EEPROM settings, so they survive a chip erase or EEPROM writes of the host. It is taken with
+ * CMD_ULTI_EEPROM_SNAPSHOT and written back with CMD_ULTI_EEPROM_RESTORE, which only writes the bytes that changed.
+ * It is only kept in RAM for this bootloader session, the host chooses the settings range.
+ * The version is given by the host for the settings layout, a snapshot is only restored for the same version.
+ * While a snapshot is held, the chip erase writes the snapshot back instead of erasing those bytes.
+ */
+#define EEPROM_SNAPSHOT_SIZE 512
+typedef struct
+{
+    uint16_t address;
+    uint16_t length;
+    uint8_t version;
+    uint16_t crc;
+    uint8_t data[EEPROM_SNAPSHOT_SIZE];
+} eepromsnapshott;
+eepromsnapshott eepromSnapshot;
+
+//Value for an EEPROM byte after a chip erase.
+static inline uint8_t eeprom_erase_value(uint16_t eeAddress)
+{
+    uint16_t offset = eeAddress - eepromSnapshot.address;
+    if (offset < eepromSnapshot.length)
+        return eepromSnapshot.data[offset];
+    return 0xFF;
+}
+
+ISR(EE_READY_vect)
+{
+    uint8_t n;
+    
+    //Disable this interrupt so it does not nest, and put the EEPROM back in erase and write mode for the application.
+    EECR = 0;
+    if (flashQueueHead != flashQueueTail)
+        return;
+    //Only the main code fills the flash queue and it cannot run before this returns, so the programming engine cannot
+    //start before the EEPROM write. Allow the serial interrupts while checking bytes.
+    sei();
+    for(n = 0; n < 32; n++)
+    {
+        uint16_t eeAddress;
+        uint8_t data;
+        uint8_t mode;
+        if (eepromErase <= E2END)
+        {
+            eeAddress = eepromErase++;
+            data = eeprom_erase_value(eeAddress);
+        }else if (eepromQueueTail != eepromQueueHead)
+        {
+            eepromwritet* entry = &eepromQueue[eepromQueueTail & (EEPROM_QUEUE_SIZE - 1)];
+            eeAddress = entry->address;
+            data = entry->data;
+            eepromQueueTail++;
+        }else{
+            return;
+        }
+        uint8_t current = eeprom_read_byte((uint8_t*)eeAddress);
+        if (current == data)
+            continue;
+        //Erase only and write only take 1.8ms, an erase and write 3.4ms. A write can only clear bits.
+        if (data == 0xFF)
+            mode = _BV(EEPM0);
+        else if ((current & data) == data)
+            mode = _BV(EEPM1);
+        else
+            mode = 0;
+        cli();
+        EEAR = eeAddress;
+        EEDR = data;
+        EECR = mode | _BV(EEMPE) | _BV(EERIE);
+        EECR |= _BV(EEPE);
+        return;
+    }
+    //Limit the bytes checked per interrupt, this interrupt fires again right away.
+    cli();
+    EECR = _BV(EERIE);
+}
+
+//Queue an EEPROM write, only bytes that change are written. Waits when the queue is full.
+static void eeprom_queue_write(uint16_t address, uint8_t data)
+{
+    while((uint8_t)(eepromQueueHead - eepromQueueTail) >= EEPROM_QUEUE_SIZE);
+    eepromwritet* entry = &eepromQueue[eepromQueueHead & (EEPROM_QUEUE_SIZE - 1)];
+    entry->address = address;
+    entry->data = data;
+    eepromQueueHead++;
+    EECR |= _BV(EERIE);
+}
+
+//Wait till all EEPROM writes and a chip erase are done.
+static void eeprom_flush()
+{
+    while(eepromQueueHead != eepromQueueTail || eepromErase <= E2END || (EECR & (_BV(EEPE) | _BV(EERIE))));
+}
+
+//Take a snapshot of the EEPROM settings, answers the CRC16-CCITT of the data.
+static uint16_t eeprom_snapshot_take(uint16_t eeAddress, uint16_t length, uint8_t version)
+{
+    uint16_t n;
+    uint16_t crc = 0xFFFF;
+    eeprom_flush();
+    eepromSnapshot.length = 0;
+    eeprom_read_block(eepromSnapshot.data, (void*)eeAddress, length);
+    for(n = 0; n < length; n++)
+        crc = crc_update(crc, eepromSnapshot.data[n]);
+    eepromSnapshot.address = eeAddress;
+    eepromSnapshot.length = length;
+    eepromSnapshot.version = version;
+    eepromSnapshot.crc = crc;
+    return crc;
+}
+
+//Write a snapshot back. The EEPROM writer skips the bytes that did not change, the count of those that did is returned.
+static uint16_t eeprom_snapshot_restore()
+{
+    uint16_t n;
+    uint16_t changed = 0;
+    //The EEPROM can only be read here while the writer is idle, so count first.
+    eeprom_flush();
+    for(n = 0; n < eepromSnapshot.length; n++)
+    {
+        if (eeprom_read_byte((uint8_t*)(eepromSnapshot.address + n)) != eepromSnapshot.data[n])
+            changed++;
+    }
+    if (changed)
+    {
+        for(n = 0; n < eepromSnapshot.length; n++)
+            eeprom_queue_write(eepromSnapshot.address + n, eepromSnapshot.data[n]);
+    }
+    return changed;
+}
+
+/*
+ * Streaming upload, started by CMD_ULTI_STREAM_START. Every CMD_ULTI_STREAM_DATA packet holds one page,
+ * and only every streamWindow packets (and the last one) are answered, so the host can keep sending.
+ */
+uint32_t streamAddress;
+uint32_t streamRemaining;
+uint8_t streamWindow;
+uint8_t streamCredit;
+uint16_t streamPages;
+
+/*
+ * Decompression for CMD_ULTI_PROGRAM_COMPRESSED, a LZSS format with a 256 byte window:
+ *  A flag byte is followed by 8 items, the lowest flag bit belongs to the first item.
+ *  A set flag bit means a literal byte, a cleared one a match of 2 bytes: distance - 1, length - 3.
+ *  Matches can overlap the output they produce, so a distance of 1 repeats the last byte.
+ * The window starts as all 0xFF at each CMD_LOAD_ADDRESS and is kept over packets, items are not split over packets.
+ * The packet starts with ULTI_COMPRESSED_* flags. The output of a packet is programmed from the current address, and has
+ * to end on a page boundary unless the packet has ULTI_COMPRESSED_LAST set.
+ * A failed packet leaves the window undefined, so the host has to start again with a CMD_LOAD_ADDRESS.
+ */
+uint8_t lzWindow[256];
+uint8_t lzPos;
+
+static void lz_output(uint8_t data)
+{
+    lzWindow[lzPos++] = data;
+    flash_stage_byte(data);
+    //Commit every page as it is done, so the output can be larger than the flash queue.
+    if (stagePages)
+        flash_stage_commit();
+}
+
+uint8_t msgBuffer[1024];
+//The flash data of CMD_PROGRAM_FLASH_ISP is staged into the flash queue, so only its 10 header bytes use msgBuffer.
+#define MAX_PACKET_SIZE (sizeof(msgBuffer) + 10)
+uint8_t seq;
+union16t msgLen;
+uint16_t msgPos;
+uint8_t checksum;
+union32t address;
+
+static void answer_byte(uint8_t data)
+{
+    SEND_SERIAL_DATA(data);
+    checksum ^= data;
+}
+
+//Start an answer with a body of msgLen bytes. The body is sent with answer_byte(), followed by SEND_SERIAL_DATA(checksum).
+static void sendHeader()
+{
+    checksum = 0;
+    answer_byte(MESSAGE_START);
+    answer_byte(seq);
+    answer_byte(msgLen.i8[1]);
+    answer_byte(msgLen.i8[0]);
+    answer_byte(TOKEN);
+}
+
+//Frame the answer in msgBuffer into the transmit queue.
+static void sendMessage()
+{
+    sendHeader();
+    for(msgPos = 0; msgPos < msgLen.i16; msgPos++)
+        answer_byte(msgBuffer[msgPos]);
+    SEND_SERIAL_DATA(checksum);
+}
+
+//Tell the host right away that the packet with the current seq was corrupted, so it can send it again.
+static void sendChecksumError()
+{
+    msgLen.i16      =   2;
+    msgBuffer[0]    =   ANSWER_CKSUM_ERROR;
+    msgBuffer[1]    =   STATUS_CKSUM_ERROR;
+    sendMessage();
+}
+
+//With ULTI_FLASH_MODE_VERIFY wait till the engine verified all pages, and replace the answer with
+// STATUS_ULTI_VERIFY_FAILED and the address of the failing byte (32bit, MSB first) when a page did not program.
+//With ULTI_FLASH_MODE_WRITE_BEHIND as well it does not wait, a failure is then reported by the first answer after it.
+static void flash_verify_answer()
+{
+    if (!(flashMode & ULTI_FLASH_MODE_VERIFY))
+        return;
+    if (!(flashMode & ULTI_FLASH_MODE_WRITE_BEHIND))
+        flash_wait();
+    if (!flashError)
+        return;
+    //The engine can still be verifying pages, take the address and clear the error together.
+    cli();
+    uint32_t errorAddress = flashErrorAddress;
+    flashError = 0;
+    sei();
+    msgLen.i16      = 6;
+    msgBuffer[1]    = STATUS_ULTI_VERIFY_FAILED;
+    msgBuffer[2]    = errorAddress >> 24;
+    msgBuffer[3]    = errorAddress >> 16;
+    msgBuffer[4]    = errorAddress >> 8;
+    msgBuffer[5]    = errorAddress;
+}
+
+//Start of a programming session, the statistics, errors and digest are per session.
+static void session_start()
+{
+    flash_wait();
+    flashPagesWritten = 0;
+    flashPagesSkipped = 0;
+    flashPagesErased = 0;
+    flashError = 0;
+    flash_digest_reset();
+}
+
+static void handleMessage()
+{
+    uint16_t newDivider = 0xFFFF;
+
+    switch(msgBuffer[0])
+    {
+    case CMD_SIGN_ON:
+        msgLen.i16		=	11;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+        msgBuffer[2] 	=	8;
+        msgBuffer[3] 	=	'A';
+        msgBuffer[4] 	=	'V';
+        msgBuffer[5] 	=	'R';
+        msgBuffer[6] 	=	'I';
+        msgBuffer[7] 	=	'S';
+        msgBuffer[8] 	=	'P';
+        msgBuffer[9] 	=	'_';
+        msgBuffer[10]	=	'2';
+        break;
+    case CMD_GET_PARAMETER:
+        switch(msgBuffer[1])
+        {
+        case PARAM_BUILD_NUMBER_LOW:
+            msgBuffer[2] = CONFIG_PARAM_BUILD_NUMBER_LOW;
+            break;
+        case PARAM_BUILD_NUMBER_HIGH:
+            msgBuffer[2] = CONFIG_PARAM_BUILD_NUMBER_HIGH;
+            break;
+        case PARAM_HW_VER:
+            msgBuffer[2] = CONFIG_PARAM_HW_VER;
+            break;
+        case PARAM_SW_MAJOR:
+            msgBuffer[2] = CONFIG_PARAM_SW_MAJOR;
+            break;
+        case PARAM_SW_MINOR:
+            msgBuffer[2] = CONFIG_PARAM_SW_MINOR;
+            break;
+        case PARAM_ULTI_FLASH_MODE:
+            msgBuffer[2] = flashMode;
+            break;
+        case PARAM_ULTI_BAUD_DIVIDER_LOW:
+            msgBuffer[2] = baudDivider;
+            break;
+        case PARAM_ULTI_BAUD_DIVIDER_HIGH:
+            msgBuffer[2] = baudDivider >> 8;
+            break;
+#ifdef AUTOBAUD
+        case PARAM_ULTI_AUTOBAUD_CYCLES_LOW:
+            msgBuffer[2] = autobaudCycles;
+            break;
+        case PARAM_ULTI_AUTOBAUD_CYCLES_HIGH:
+            msgBuffer[2] = autobaudCycles >> 8;
+            break;
+#endif
+        }
+        msgLen.i16  	=	3;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+        break;
+//    case CMD_SET_DEVICE_PARAMETERS:
+//    case CMD_OSCCAL:
+    case CMD_LOAD_ADDRESS:
+        address.i8[3]   = msgBuffer[1];
+        address.i8[2]   = msgBuffer[2];
+        address.i8[1]   = msgBuffer[3];
+        address.i8[0]   = msgBuffer[4];
+        address.i32   <<= 1;
+        memset(lzWindow, 0xFF, sizeof(lzWindow));
+        lzPos           = 0;
+        msgLen.i16 		= 2;
+        msgBuffer[1] 	= STATUS_CMD_OK;
+        break;
+//    case CMD_FIRMWARE_UPGRADE:
+    case CMD_ULTI_SET_BAUD:
+        {
+            union32t baud;
+            baud.i8[3] = msgBuffer[1];
+            baud.i8[2] = msgBuffer[2];
+            baud.i8[1] = msgBuffer[3];
+            baud.i8[0] = msgBuffer[4];
+            msgLen.i16 		=	2;
+            msgBuffer[1] 	=	STATUS_CMD_FAILED;
+            if (baud.i32 == 0)
+                break;
+            //Same calculation as BAUDRATE_DIVIDER(), the UBRR0 register is only 12 bits.
+            baud.i32 = ((F_CPU + (4 * baud.i32)) / (8 * baud.i32)) - 1;
+            if (baud.i32 > 0x0FFF)
+                break;
+            newDivider = baud.i16[0];
+            msgBuffer[1] 	=	STATUS_CMD_OK;
+        }
+        break;
+    case CMD_SET_PARAMETER:
+        if (msgBuffer[1] == PARAM_ULTI_FLASH_MODE)
+        {
+            flash_wait();
+            flashMode = msgBuffer[2];
+        }
+        msgLen.i16 		=	2;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+        break;
+    case CMD_ENTER_PROGMODE_ISP:
+        session_start();
+        msgLen.i16 		=	2;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+        break;
+    case CMD_LEAVE_PROGMODE_ISP:
+        msgLen.i16 		=	2;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+        //Pages still written behind can fail after the last program answer, report that instead of leaving.
+        flash_erase_finish();
+        eeprom_flush();
+        flash_verify_answer();
+        if (msgBuffer[1] != STATUS_CMD_OK)
+            break;
+        //To leave the bootloader, set the timer really fast
+        TCCR1B = _BV(CS10);
+        break;
+    case CMD_CHIP_ERASE_ISP:
+        msgLen.i16 		=	2;
+        msgBuffer[1] 	=	STATUS_CMD_OK;
+
+        //Answer right away, the flash is erased when needed and the EEPROM in the background, see flash_erase_finish().
+        memset(flashEraseMap, 0xFF, sizeof(flashEraseMap));
+        flashErasePending = 1;
+        cli();
+        eepromQueueTail = eepromQueueHead;
+        eepromErase = 0;
+        sei();
+        EECR |= _BV(EERIE);
+        break;
+    case CMD_PROGRAM_FLASH_ISP:
+        {
+            //lcd_home();
+            //lcd_pstring(PSTR("Loading new firmware"));
+            
+            union16t size;
+            size.i8[0] = msgBuffer[2];
+            size.i8[1] = msgBuffer[1];
+            
+            //The data itself is not in msgBuffer, it was staged into the flash queue while receiving. See STATE_DATA.
+            if (size.i16 != msgLen.i16 - 10)
+            {
+                msgLen.i16 		=	2;
+                msgBuffer[1] 	=	STATUS_CMD_FAILED;
+                break;
+            }
+            msgLen.i16 		=	2;
+            msgBuffer[1] 	=	STATUS_CMD_OK;
+            
+            //Hand the staged pages to the programming engine, this does not wait for the erase and write to finish.
+            flash_stage_commit();
+            address.i32 += size.i16;
+            //Only answer when the largest next packet fits in the flash queue, which can be 5 pages when it is not page aligned.
+            //Otherwise staging it would wait for the engine while receiving, and the serial receive buffer overflows.
+            flash_queue_next(sizeof(msgBuffer) / SPM_PAGESIZE);
+            flash_verify_answer();
+        }
+        break;
+    case CMD_READ_FLASH_ISP:
+        {
+            union16t size;
+            size.i8[0] = msgBuffer[2];
+            size.i8[1] = msgBuffer[1];
+            if (size.i16 == 0 || size.i16 > 0xFFFF - 3)
+            {
+                msgLen.i16 		=	2;
+                msgBuffer[1] 	=	STATUS_CMD_FAILED;
+                break;
+            }
+            
+            //Send the flash straight from the reader into the transmit queue instead of copying it into msgBuffer first.
+            //Reading a byte is much faster than sending it, so the serial never waits, and the size is not limited by msgBuffer.
+            flash_erase_finish();
+            msgLen.i16 = size.i16 + 3;
+            sendHeader();
+            answer_byte(CMD_READ_FLASH_ISP);
+            answer_byte(STATUS_CMD_OK);
+            uint16_t z = flash_read_start(address.i32);
+            address.i32 += size.i16;
+            do
+            {
+                answer_byte(flash_read_next(z));
+            }while(--size.i16);
+            answer_byte(STATUS_CMD_OK);
+            SEND_SERIAL_DATA(checksum);
+            msgLen.i16 = 0;
+        }
+        break;
+    case CMD_ULTI_STREAM_START:
+        {
+            union32t start, length;
+            start.i8[3]     = msgBuffer[1];
+            start.i8[2]     = msgBuffer[2];
+            start.i8[1]     = msgBuffer[3];
+            start.i8[0]     = msgBuffer[4];
+            length.i8[3]    = msgBuffer[5];
+            length.i8[2]    = msgBuffer[6];
+            length.i8[1]    = msgBuffer[7];
+            length.i8[0]    = msgBuffer[8];
+            streamAddress   = start.i32;
+            streamWindow    = msgBuffer[9];
+            streamCredit    = streamWindow;
+            streamPages     = 0;
+            streamRemaining = 0;
+            flash_digest_reset();
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            //Every packet is one page, and a whole window of pages has to fit in the flash queue.
+            if ((streamAddress & (SPM_PAGESIZE - 1)) || streamWindow == 0 || streamWindow > FLASH_QUEUE_SIZE)
+                break;
+            streamRemaining = length.i32;
+            msgBuffer[1]    = STATUS_CMD_OK;
+        }
+        break;
+    case CMD_ULTI_STREAM_DATA:
+        {
+            //The data was staged into the flash queue while receiving, like CMD_PROGRAM_FLASH_ISP.
+            uint16_t size = msgLen.i16 - 1;
+            if (streamRemaining == 0 || size > streamRemaining || (size != SPM_PAGESIZE && size != streamRemaining))
+            {
+                streamRemaining = 0;
+                msgLen.i16      = 2;
+                msgBuffer[1]    = STATUS_CMD_FAILED;
+                break;
+            }
+            flash_stage_commit();
+            streamAddress += size;
+            streamRemaining -= size;
+            streamPages++;
+            if (--streamCredit && streamRemaining)
+            {
+                //No answer inside the window.
+                msgLen.i16 = 0;
+                break;
+            }
+            //Only answer when the next window of pages fits in the flash queue, so the host cannot overrun us.
+            flash_queue_next(streamWindow - 1);
+            streamCredit    = streamWindow;
+            msgLen.i16      = 6;
+            msgBuffer[1]    = STATUS_CMD_OK;
+            msgBuffer[2]    = streamPages >> 8;
+            msgBuffer[3]    = streamPages;
+            msgBuffer[4]    = flashCrc >> 8;
+            msgBuffer[5]    = flashCrc;
+            flash_verify_answer();
+        }
+        break;
+    case CMD_ULTI_PROGRAM_COMPRESSED:
+        {
+            uint8_t* c = &msgBuffer[2];
+            uint8_t* end = &msgBuffer[msgLen.i16];
+            uint8_t packetFlags = msgBuffer[1];
+            uint8_t flags = 0;
+            uint8_t items = 0;
+            
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            if (c > end)
+                break;
+            flash_stage_begin(address.i32);
+            while(c < end)
+            {
+                if (items == 0)
+                {
+                    flags = *c++;
+                    items = 8;
+                    continue;
+                }
+                if (flags & 0x01)
+                {
+                    lz_output(*c++);
+                }else{
+                    //A match cut off by the end of the packet.
+                    if (end - c < 2)
+                        break;
+                    uint8_t from = lzPos - c[0] - 1;
+                    uint16_t len = c[1] + 3;
+                    c += 2;
+                    while(len--)
+                        lz_output(lzWindow[from++]);
+                }
+                flags >>= 1;
+                items--;
+            }
+            //A partial page would be padded with 0xFF, and the next packet would overwrite its start with 0xFF again.
+            //The full pages are committed already, the partial one is simply dropped on a failure.
+            if (c < end || (stagePage && !(packetFlags & ULTI_COMPRESSED_LAST)))
+                break;
+            flash_stage_commit();
+            address.i32 = stageAddress;
+            msgBuffer[1]    = STATUS_CMD_OK;
+            flash_verify_answer();
+        }
+        break;
+    case CMD_ULTI_PAGE_CRC:
+        {
+            union16t page, count;
+            page.i8[1]  = msgBuffer[1];
+            page.i8[0]  = msgBuffer[2];
+            count.i8[1] = msgBuffer[3];
+            count.i8[0] = msgBuffer[4];
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            if (count.i16 > (sizeof(msgBuffer) - 2) / 2 || page.i16 > (FLASHEND + 1UL) / SPM_PAGESIZE || count.i16 > (FLASHEND + 1UL) / SPM_PAGESIZE - page.i16)
+                break;
+            
+            //One CRC per page, so the host only has to send the pages that differ.
+            uint8_t* c = &msgBuffer[2];
+            flash_erase_finish();
+            while(count.i16)
+            {
+                uint16_t crc = flash_crc(0xFFFF, (uint32_t)page.i16 * SPM_PAGESIZE, SPM_PAGESIZE);
+                *c++ = crc >> 8;
+                *c++ = crc;
+                page.i16++;
+                count.i16--;
+            }
+            msgLen.i16      = c - msgBuffer;
+            msgBuffer[1]    = STATUS_CMD_OK;
+        }
+        break;
+    case CMD_ULTI_CRC:
+        {
+            union32t start, length;
+            start.i8[3]     = msgBuffer[1];
+            start.i8[2]     = msgBuffer[2];
+            start.i8[1]     = msgBuffer[3];
+            start.i8[0]     = msgBuffer[4];
+            length.i8[3]    = msgBuffer[5];
+            length.i8[2]    = msgBuffer[6];
+            length.i8[1]    = msgBuffer[7];
+            length.i8[0]    = msgBuffer[8];
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            if (start.i32 > FLASHEND + 1UL || length.i32 > FLASHEND + 1UL - start.i32)
+                break;
+            
+            //Lets the host verify any range without reading it back, the whole application area takes about half a second.
+            flash_erase_finish();
+            uint16_t crc = flash_crc(0xFFFF, start.i32, length.i32);
+            msgLen.i16      = 4;
+            msgBuffer[1]    = STATUS_CMD_OK;
+            msgBuffer[2]    = crc >> 8;
+            msgBuffer[3]    = crc;
+        }
+        break;
+    case CMD_ULTI_GET_DIGEST:
+        msgLen.i16      = 8;
+        msgBuffer[1]    = STATUS_CMD_OK;
+        msgBuffer[2]    = flashCrc >> 8;
+        msgBuffer[3]    = flashCrc;
+        msgBuffer[4]    = flashBytes >> 24;
+        msgBuffer[5]    = flashBytes >> 16;
+        msgBuffer[6]    = flashBytes >> 8;
+        msgBuffer[7]    = flashBytes;
+        break;
+    case CMD_ULTI_SESSION_INFO:
+        {
+            //Everything avrdude collects in a dozen round trips before programming, and enters programming mode.
+            session_start();
+            uint8_t* c = &msgBuffer[1];
+            *c++ = STATUS_CMD_OK;
+            *c++ = (SIGNATURE_BYTES >> 16) & 0xFF;
+            *c++ = (SIGNATURE_BYTES >> 8) & 0xFF;
+            *c++ = SIGNATURE_BYTES & 0xFF;
+            *c++ = boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+            *c++ = boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+            *c++ = boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
+            *c++ = boot_lock_fuse_bits_get(GET_LOCK_BITS);
+            *c++ = CONFIG_PARAM_BUILD_NUMBER_HIGH;
+            *c++ = CONFIG_PARAM_BUILD_NUMBER_LOW;
+            *c++ = CONFIG_PARAM_HW_VER;
+            *c++ = CONFIG_PARAM_SW_MAJOR;
+            *c++ = CONFIG_PARAM_SW_MINOR;
+            *c++ = SPM_PAGESIZE >> 8;
+            *c++ = SPM_PAGESIZE & 0xFF;
+            *c++ = MAX_PACKET_SIZE >> 8;
+            *c++ = MAX_PACKET_SIZE & 0xFF;
+            *c++ = (BOOTSTART >> 24) & 0xFF;
+            *c++ = (BOOTSTART >> 16) & 0xFF;
+            *c++ = (BOOTSTART >> 8) & 0xFF;
+            *c++ = BOOTSTART & 0xFF;
+            *c++ = (E2END + 1) >> 8;
+            *c++ = (E2END + 1) & 0xFF;
+            *c++ = ULTI_CAP_SET_BAUD | ULTI_CAP_STREAM | ULTI_CAP_COMPRESSED | ULTI_CAP_CRC | ULTI_CAP_VERIFY | ULTI_CAP_EEPROM | ULTI_CAP_EEPROM_SNAPSHOT
+#ifdef AUTOBAUD
+                | ULTI_CAP_AUTOBAUD
+#endif
+                ;
+            *c++ = flashMode;
+            msgLen.i16 = c - msgBuffer;
+        }
+        break;
+    case CMD_ULTI_EEPROM_SNAPSHOT:
+        {
+            union16t eeAddress, length;
+            eeAddress.i8[1] = msgBuffer[1];
+            eeAddress.i8[0] = msgBuffer[2];
+            length.i8[1]    = msgBuffer[3];
+            length.i8[0]    = msgBuffer[4];
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            if (length.i16 > EEPROM_SNAPSHOT_SIZE || eeAddress.i16 > E2END + 1 || length.i16 > E2END + 1 - eeAddress.i16)
+                break;
+            //A length of 0 drops the snapshot.
+            uint16_t crc = eeprom_snapshot_take(eeAddress.i16, length.i16, msgBuffer[5]);
+            msgLen.i16      = 4;
+            msgBuffer[1]    = STATUS_CMD_OK;
+            msgBuffer[2]    = crc >> 8;
+            msgBuffer[3]    = crc;
+        }
+        break;
+    case CMD_ULTI_EEPROM_RESTORE:
+        {
+            uint8_t version = msgBuffer[1];
+            msgLen.i16      = 2;
+            msgBuffer[1]    = STATUS_CMD_FAILED;
+            if (eepromSnapshot.length == 0 || version != eepromSnapshot.version)
+                break;
+            uint16_t changed = eeprom_snapshot_restore();
+            msgLen.i16      = 4;
+            msgBuffer[1]    = STATUS_CMD_OK;
+            msgBuffer[2]    = changed >> 8;
+            msgBuffer[3]    = changed;
+        }
+        break;
+    case CMD_ULTI_GET_STATS:
+        //Wait for the engine, so the statistics include every page sent so far.
+        flash_wait();
+        msgLen.i16      = 8;
+        msgBuffer[1]    = STATUS_CMD_OK;
+        msgBuffer[2]    = flashPagesWritten >> 8;
+        msgBuffer[3]    = flashPagesWritten;
+        msgBuffer[4]    = flashPagesSkipped >> 8;
+        msgBuffer[5]    = flashPagesSkipped;
+        msgBuffer[6]    = flashPagesErased >> 8;
+        msgBuffer[7]    = flashPagesErased;
+        break;
+    case CMD_ULTI_CHECKSUM:
+        //Byte sum from 0 up to the current address, kept for older hosts. CMD_ULTI_CRC catches more errors.
+        {
+            union16t checksum;
+            uint32_t length = (address.i32 + 1) & ~1UL;//Whole words, like the original word reads.
+            checksum.i16 = 0;
+            flash_erase_finish();
+            uint16_t z = flash_read_start(0);
+            while(length)
+            {
+                uint16_t count = length > 0x8000 ? 0x8000 : length;
+                length -= count;
+                do
+                {
+                    checksum.i16 += flash_read_next(z);
+                }while(--count);
+            }
+            msgBuffer[2] = checksum.i8[0];
+            msgBuffer[3] = checksum.i8[1];
+            msgLen.i16 = 4;
+            msgBuffer[1] = STATUS_CMD_OK;
+        }
+        break;
+    case CMD_PROGRAM_EEPROM_ISP:
+        {
+            //The EEPROM address is the byte address, while the address counts 2 per byte like the Arduino stk500v2 bootloader.
+            union16t size;
+            size.i8[0] = msgBuffer[2];
+            size.i8[1] = msgBuffer[1];
+            uint16_t eeAddress = address.i32 >> 1;
+            if (size.i16 != msgLen.i16 - 10 || eeAddress > E2END + 1 || size.i16 > E2END + 1 - eeAddress)
+            {
+                msgLen.i16 		=	2;
+                msgBuffer[1] 	=	STATUS_CMD_FAILED;
+                break;
+            }
+            
+            //Only bytes that change are written, so restoring mostly unchanged settings is fast.
+            uint8_t* c = &msgBuffer[10];
+            address.i32 += (uint32_t)size.i16 << 1;
+            while(size.i16--)
+                eeprom_queue_write(eeAddress++, *c++);
+            msgLen.i16 		=	2;
+            msgBuffer[1] 	=	STATUS_CMD_OK;
+        }
+        break;
+    case CMD_READ_EEPROM_ISP:
+        {
+            union16t size;
+            size.i8[0] = msgBuffer[2];
+            size.i8[1] = msgBuffer[1];
+            uint16_t eeAddress = address.i32 >> 1;
+            msgLen.i16 		=	2;
+            msgBuffer[1] 	=	STATUS_CMD_FAILED;
+            if (size.i16 > sizeof(msgBuffer) - 3 || eeAddress > E2END + 1 || size.i16 > E2END + 1 - eeAddress)
+                break;
+            
+            eeprom_flush();
+            eeprom_read_block(&msgBuffer[2], (void*)eeAddress, size.i16);
+            address.i32 += (uint32_t)size.i16 << 1;
+            msgLen.i16 		=	size.i16 + 3;
+            msgBuffer[1] 	=	STATUS_CMD_OK;
+            msgBuffer[size.i16 + 2] = STATUS_CMD_OK;
+        }
+        break;
+//    case CMD_PROGRAM_FUSE_ISP:
+    case CMD_READ_FUSE_ISP:
+        //Reading the fuses overwrites SPMCSR, which would disable the SPM ready interrupt of a busy programming engine.
+        flash_wait();
+        if ( msgBuffer[2] == 0x50 )
+        {
+            if ( msgBuffer[3] == 0x08 )
+                msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_EXTENDED_FUSE_BITS );
+            else
+                msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_LOW_FUSE_BITS );
+        }
+        else
+        {
+            msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_HIGH_FUSE_BITS );
+        }
+        msgLen.i16		=	4;
+        msgBuffer[1]	=	STATUS_CMD_OK;
+        msgBuffer[3]	=	STATUS_CMD_OK;
+        break;
+    //case CMD_PROGRAM_LOCK_ISP:
+    case CMD_READ_LOCK_ISP:
+        flash_wait();
+        msgLen.i16		=	4;
+        msgBuffer[1]	=	STATUS_CMD_OK;
+        msgBuffer[2]	=	boot_lock_fuse_bits_get( GET_LOCK_BITS );
+        msgBuffer[3]	=	STATUS_CMD_OK;
+        break;
+    case CMD_READ_SIGNATURE_ISP:
+        if ( msgBuffer[4] == 0 )
+            msgBuffer[2] = (SIGNATURE_BYTES >>16) & 0x000000FF;
+        else if ( msgBuffer[4] == 1 )
+            msgBuffer[2] = (SIGNATURE_BYTES >> 8) & 0x000000FF;
+        else
+            msgBuffer[2] = SIGNATURE_BYTES & 0x000000FF;
+        msgLen.i16      =	4;
+        msgBuffer[1]	=	STATUS_CMD_OK;
+        msgBuffer[3]	=	STATUS_CMD_OK;
+        break;
+//    case CMD_READ_OSCCAL_ISP:
+    case CMD_SPI_MULTI:
+        //Implement only the signature bytes reading for raw ISP commands, avrdude needs this.
+        msgBuffer[5]	=	0;
+        if ( msgBuffer[4] == 0x30 )
+        {
+            if ( msgBuffer[6] == 0 )
+                msgBuffer[5]	=	(SIGNATURE_BYTES >>16) & 0x000000FF;
+            else if ( msgBuffer[6] == 1 )
+                msgBuffer[5]	=	(SIGNATURE_BYTES >> 8) & 0x000000FF;
+            else
+                msgBuffer[5]	=	SIGNATURE_BYTES & 0x000000FF;
+        }
+        
+        msgLen.i16		=	7;
+        msgBuffer[1]	=	STATUS_CMD_OK;
+        msgBuffer[2]	=	0;
+        msgBuffer[3]	=	msgBuffer[4];
+        msgBuffer[4]	=	0;
+        msgBuffer[6]	=	STATUS_CMD_OK;
+        break;
+    default:
+        msgLen.i16 		=	2;
+        msgBuffer[1] 	=	STATUS_CMD_FAILED;
+        break;
+    }
+    if (msgLen.i16)
+        sendMessage();
+    
+    seq++;
+    
+    if (newDivider != 0xFFFF)
+    {
+        //Switch only after the answer went out at the old baudrate, and start the fallback timer.
+        serial_flush();
+        serial_set_divider(newDivider);
+        baudPending = 1;
+        TCCR3B = 0;
+        TCNT3 = 0;
+        TIFR3 = _BV(TOV3);
+        TCCR3B = BAUD_FALLBACK_PRESCALER;
+        TCNT1H = 0;
+        TCNT1L = 0;
+    }
+}
+
+void main()
+{
+    uint8_t recvState = STATE_START;
+    uint8_t stageOffset = 0;
+    uint8_t packetSeq = 0;
+    uint8_t hasFirmware = (pgm_read_byte(0) == 0xFF);
+    FATFS fat;
+    
+    //lcd_init();
+    if (hasFirmware)
+    {
+        //lcd_pstring(PSTR("No firmware found..."));
+    }else{
+        //lcd_pstring(PSTR("Ultimaker starting.."));
+    }
+    
+    SET_INPUT(BTN_ENC);
+    WRITE(BTN_ENC, 1);//Enable the pull-up on the button input.
+    
+    //Move the interrupt vectors to the bootloader section. The application section cannot be read while SPM is busy,
+    // so vectors at address 0 would not work while flashing. IVSEL has to be written within 4 cycles after IVCE.
+    MCUCR = _BV(IVCE);
+    MCUCR = _BV(IVSEL);
+
+    //Setup the serial with 8n1 and the configured baudrate. The receiver is enabled after the autobaud.
+    UCSR0A = _BV(U2X0);
+    UCSR0B = _BV(TXEN0);
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+    baudDivider = BAUDRATE_DIVIDER();
+    serial_set_divider(baudDivider);
+    sei();
+    
+    crc_init();
+    
+    if (MCUSR_backup & _BV(WDRF))
+    {
+        //If we had a hardware watchdog timeout, report that to the user and don't do anything else.
+        //As a hardware watchdog error is a critical error and should not recover.
+        //lcd_clear();
+        //lcd_pstring(PSTR("Hardware watchdog"));
+        //lcd_set_pos(0x40);
+        //lcd_pstring(PSTR("timeout..."));
+        //led_write(8, 0x01);
+        while(1)
+        {
+            serial_send_pstring(PSTR("Error: Hardware watchdog timeout\n"));
+        }
+    }
+
+    //Setup a bootloader timeout timer, use a 16bit timer. And wait for the overflow.
+    //With a 1024 prescaler this gives a ~4.1 second timeout.
+    //With a 256 prescaler this gives a ~1 second timeout.
+    //TCCR1B = _BV(CS12) | _BV(CS10);//1024 prescaler
+    TCCR1B = _BV(CS12);//256 prescaler
+    //TCCR1B = _BV(CS11) | _BV(CS10);//64 prescaler
+    TIFR1 = _BV(TOV1);
+    TCNT1H = 0;
+    TCNT1L = 0;
+    
+#ifdef AUTOBAUD
+    TCCR3B = _BV(CS30);
+    while(!(TIFR1 & _BV(TOV1)))
+    {
+        if (autobaud())
+        {
+            //The measured byte was the MESSAGE_START, so continue with the rest of the packet.
+            recvState = STATE_SEQ;
+            checksum = MESSAGE_START;
+            TCNT1H = 0;
+            TCNT1L = 0;
+            break;
+        }
+    }
+    TCCR3B = 0;
+#else
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+#endif
+    
+    while(!(TIFR1 & _BV(TOV1)))
+    {
+        if (baudPending && (TIFR3 & _BV(TOV3)))
+        {
+            //No valid packet at the new baudrate, go back to the old one.
+            TCCR3B = 0;
+            baudPending = 0;
+            serial_set_divider(baudDivider);
+            recvState = STATE_START;
+        }
+        if (SERIAL_DATA_AVAILABLE())
+        {
+            if (serial_recv_error())
+            {
+                //Data was lost or corrupted here, drop the packet we were receiving and resync on the next MESSAGE_START.
+                if (recvState != STATE_START)
+                    sendChecksumError();
+                recvState = STATE_START;
+            }
+            uint8_t data = RECV_SERIAL_DATA();
+            
+            checksum ^= data;
+            switch(recvState)
+            {
+            case STATE_START:
+                if (data == MESSAGE_START)
+                {
+                    recvState = STATE_SEQ;
+                    checksum = MESSAGE_START;
+                    //Reset the bootloader timeout
+                    TCNT1H = 0;
+                    TCNT1L = 0;
+                    //led_write(8, 0x00);
+                }
+                break;
+            case STATE_SEQ:
+                if ((data == 1) || (data == seq))
+                {
+                    //Starting over at seq 1 is handled when the command is known, see STATE_DATA.
+                    packetSeq = data;
+                    recvState = STATE_SIZE_1;
+                }else{
+                    recvState = STATE_START;
+                }
+                break;
+            case STATE_SIZE_1:
+                msgLen.i8[1] = data;
+                recvState = STATE_SIZE_2;
+                break;
+            case STATE_SIZE_2:
+                msgLen.i8[0] = data;
+                recvState = STATE_TOKEN;
+                break;
+            case STATE_TOKEN:
+                if (data == TOKEN && msgLen.i16 > 0 && msgLen.i16 <= MAX_PACKET_SIZE)
+                {
+                    recvState = STATE_DATA;
+                    msgPos = 0;
+                }else{
+                    recvState = STATE_START;
+                }
+                break;
+            case STATE_DATA:
+                if (msgPos == 0)
+                {
+                    if (packetSeq != seq)
+                    {
+                        //A stream packet with seq 1 is a pipelined one that wrapped around after a dropped packet, not a
+                        // restart. Ignore it like the other packets after the dropped one, so the host can resend them.
+                        if (streamRemaining && data == CMD_ULTI_STREAM_DATA)
+                        {
+                            recvState = STATE_START;
+                            break;
+                        }
+                        //Starting over at seq 1 means the host restarted, any streaming upload is gone with it.
+                        streamRemaining = 0;
+                    }
+                    seq = packetSeq;
+                    //Flash data goes straight into the flash queue, and is committed when the checksum is OK.
+                    stageOffset = 0;
+                    if (data == CMD_PROGRAM_FLASH_ISP)
+                    {
+                        stageOffset = 10;
+                        flash_stage_begin(address.i32);
+                    }
+                    if (data == CMD_ULTI_STREAM_DATA && streamRemaining)
+                    {
+                        stageOffset = 1;
+                        flash_stage_begin(streamAddress);
+                    }
+                }
+                if (stageOffset && msgPos >= stageOffset)
+                {
+                    flash_stage_byte(data);
+                    msgPos++;
+                }else{
+                    //The rest of a packet that does not fit is thrown away, and answered with a failure.
+                    if (msgPos < sizeof(msgBuffer))
+                        msgBuffer[msgPos] = data;
+                    msgPos++;
+                }
+                if (msgPos == msgLen.i16)
+                    recvState = STATE_CHECK;
+                break;
+            case STATE_CHECK:
+                //led_write(8, 0x2A);
+                if (checksum == 0)
+                {
+                    if (baudPending)
+                    {
+                        //A valid packet arrived at the new baudrate, make it the confirmed one.
+                        TCCR3B = 0;
+                        baudPending = 0;
+                        baudDivider = UBRR0;
+                    }
+                    if (stageOffset == 0 && msgLen.i16 > sizeof(msgBuffer))
+                    {
+                        msgLen.i16      = 2;
+                        msgBuffer[1]    = STATUS_CMD_FAILED;
+                        sendMessage();
+                        seq++;
+                    }else{
+                        handleMessage();
+                    }
+                    //Handling the message can take a while, restart the bootloader timeout from here.
+                    TCNT1H = 0;
+                    TCNT1L = 0;
+                    TIFR1 = _BV(TOV1);
+                }else{
+                    sendChecksumError();
+                }
+                recvState = STATE_START;
+                break;
+            }
+        }
+    }
+
+    /*
+    //Try the SD card to see if there is a firmware on it.
+    if (pf_mount(&fat) == 0 && pf_open("/firmware.bin") == 0)
+    {
+        led_write(8, 0x0A);
+        TCCR1B = _BV(CS12) | _BV(CS10);//1024 prescaler for 4 second timeout
+        TIFR1 = _BV(TOV1);
+        TCNT1H = 0;
+        TCNT1L = 0;
+        lcd_clear();
+        lcd_pstring(PSTR("Press button to"));
+        lcd_set_pos(0x40);
+        lcd_pstring(PSTR("upgrade firmware"));
+        while(!(TIFR1 & _BV(TOV1)))
+        {
+            if (hasFirmware || !READ(BTN_ENC))
+            {
+                lcd_clear();
+                lcd_pstring(PSTR("Upgrading firmware"));
+                
+                uint8_t buffer[SPM_PAGESIZE];
+                uint32_t address = 0;
+                while(1)
+                {
+                    WORD len;
+                    
+                    //Read straight into the flash queue, the SD card is read while the previous page is programmed.
+                    flashpaget* page = flash_queue_next(0);
+                    pf_read(page->data, SPM_PAGESIZE, &len);
+                    if (len == 0)
+                        break;
+                    lcd_set_pos(0x40 + address * 20L / fat.fsize);
+                    lcd_send_8bit(0xFF);
+                    //Protect the bootloader
+                    if (address >= BOOTSTART)
+                        break;
+
+                    memset(&page->data[len], 0xFF, SPM_PAGESIZE - len);
+                    page->address = address;
+                    page->sweep = 0;
+                    flash_queue_push(1);
+                    address += SPM_PAGESIZE;
+                }
+                flash_wait();
+                lcd_clear();
+                lcd_pstring(PSTR("Checking firmware"));
+                //Reopen the firmware to reset the file read pointer
+                pf_open("/firmware.bin");
+                address = 0;
+                uint16_t z = flash_read_start(0);
+                while(1)
+                {
+                    WORD len;
+                    
+                    pf_read(buffer, SPM_PAGESIZE, &len);
+                    if (len == 0)
+                        break;
+                    lcd_set_pos(0x40 + address * 20L / fat.fsize);
+                    lcd_send_8bit(0xFF);
+                    
+                    //The lcd and SD card code does not touch RAMPZ, so the flash read continues where the last block stopped.
+                    uint8_t* c = buffer;
+                    address += len;
+                    do
+                    {
+                        if (*c++ != flash_read_next(z))
+                        {
+                            lcd_clear();
+                            lcd_pstring(PSTR("FAILED!"));
+                            while(1);
+                        }
+                        len --;
+                    } while(len);
+                }
+                lcd_clear();
+                lcd_pstring(PSTR("DONE!"));
+                break;
+            }
+        }
+    }
+    */
+
+    //Give the hardware back to the application like we found it: no serial interrupts and the vectors at address 0.
+    flash_erase_finish();
+    eeprom_flush();
+    serial_flush();
+    cli();
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0);
+    TCCR3B = 0;
+    MCUCR = _BV(IVCE);
+    MCUCR = 0;
+
+    //Jump to address 0x0000
+	asm volatile(
+			"clr	r30		\n\t"
+			"clr	r31		\n\t"
+			"ijmp	\n\t"
+			);
+}